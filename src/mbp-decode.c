@@ -22,13 +22,31 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <setjmp.h>
 #include <unistd.h>
 #include <endian.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
 
 FILE *infile;
 FILE *outfile;
 
+// memory-mapped input, used instead of infile when the input is a regular file
+int            infile_fd = -1;
+unsigned char *inmap = NULL;
+size_t         inmap_length = 0;
+size_t         inmap_offset = 0;
+
 uint32_t read_32be_int();
+void     read_header_data( void *buffer, size_t length );
+int      analyse_jpeg( const unsigned char *data, size_t length, uint64_t *phash, uint64_t *dhash, uint32_t *colour );
+void     resample_gray( const unsigned char *gray, int width, int height, float *out, int out_width, int out_height );
+int      compare_floats( const void *a, const void *b );
 
 int main( int argc, char** argv ) {
 	
@@ -80,19 +98,27 @@ int main( int argc, char** argv ) {
 	uint32_t mbp_palettesize = 0;
 	uint32_t mbp_data_length = 0;
 	char*    mbp_data = NULL;
+	size_t   mbp_data_offset = 0;
+	size_t   page_size = sysconf( _SC_PAGESIZE );
+	struct stat infile_stat;
 	
 	int c;
 	opterr = 0;
 	int help = 0;
+	int analyse = 0;
+	uint64_t analysis_phash;
+	uint64_t analysis_dhash;
+	uint32_t analysis_colour;
 	
 	// process options
-	while( ( c = getopt ( argc, argv, "pntmdho:" ) ) != -1 )
+	while( ( c = getopt ( argc, argv, "pntmdaho:" ) ) != -1 )
 		switch( c ) {
 			case 'p': mode = 0; break;
 			case 'n': mode = 1; break;
 			case 't': mode = 2; break;
 			case 'm': mode = 3; break;
 			case 'd': mode = 4; break;
+			case 'a': analyse = 1; break;
 			case 'h': help = 1; break;
 			case 'o':
 				outfile_name = optarg;
@@ -129,10 +155,13 @@ int main( int argc, char** argv ) {
 		fprintf( stderr, " -t                   print descriptive picture type\n" );
 		fprintf( stderr, " -m                   print picture MIME type\n" );
 		fprintf( stderr, " -d                   print picture description\n" );
+		fprintf( stderr, " -a                   also analyse the picture (JPEG only), printing its perceptual\n" );
+		fprintf( stderr, "                      hash, difference hash and dominant colour to stderr\n" );
 		fprintf( stderr, " -h                   print this help\n" );
 		fprintf( stderr, "\n" );
 		fprintf( stderr, "One option between -p, -n, -t, -m or -d is mandatory\n" );
 		fprintf( stderr, "If more than one is used, the last one wins\n" );
+		fprintf( stderr, "-a can be combined with any of them\n" );
 		fprintf( stderr, "\n" );
 		return 1;
 	} else {
@@ -153,11 +182,28 @@ int main( int argc, char** argv ) {
 	} else if( optind == argc-1 ) { // 1 argument left: it's the input filename
 		infile_name = argv[ optind ];
 		fprintf( stderr, "Reading data from file %s\n", infile_name );
-		infile = fopen( infile_name, "rb" );
-		if( infile == NULL ) { 
+		infile_fd = open( infile_name, O_RDONLY );
+		if( infile_fd == -1 ) {
 			fprintf( stderr, "Error: cannot open input file.\n" );
 			abort();
 		}
+		// regular files are mapped, so that headers are read without stdio
+		// buffering and the picture data is never copied
+		if( fstat( infile_fd, &infile_stat ) == 0 && S_ISREG( infile_stat.st_mode ) && infile_stat.st_size > 0 ) {
+			inmap = mmap( NULL, infile_stat.st_size, PROT_READ, MAP_PRIVATE, infile_fd, 0 );
+			if( inmap == MAP_FAILED ) {
+				inmap = NULL;
+			} else {
+				inmap_length = infile_stat.st_size;
+			}
+		}
+		if( inmap == NULL ) {
+			infile = fdopen( infile_fd, "rb" );
+			if( infile == NULL ) {
+				fprintf( stderr, "Error: cannot open input file.\n" );
+				abort();
+			}
+		}
 	} else { // 2 or more arguments left: it's an error
 		fprintf( stderr, "Error: too many arguments.\n" );
 		abort();
@@ -195,18 +241,9 @@ int main( int argc, char** argv ) {
 		fprintf( stderr, "Error: memory allocation failed.\n" );
 		abort();
 	}
-	bytes_read = fread( mbp_mime_text, 1, mbp_mime_length, infile );
-	if( bytes_read < mbp_mime_length ) {
-		if( feof( infile ) ) {
-			fprintf( stderr, "Error: unexpected end of file while reading header.\n" );
-		} else {
-			fprintf( stderr, "Error: file error while reading header.\n" );
-		}
-		abort();
-	} else {
-		mbp_mime_text[ mbp_mime_length ] = '\0';
-		fprintf( stderr, "MIME type: %s\n", mbp_mime_text );
-	}
+	read_header_data( mbp_mime_text, mbp_mime_length );
+	mbp_mime_text[ mbp_mime_length ] = '\0';
+	fprintf( stderr, "MIME type: %s\n", mbp_mime_text );
 	
 	// description
 	mbp_description_length = read_32be_int();
@@ -215,18 +252,9 @@ int main( int argc, char** argv ) {
 		fprintf( stderr, "Error: memory allocation failed.\n" );
 		abort();
 	}
-	bytes_read = fread( mbp_description_text, 1, mbp_description_length, infile );
-	if( bytes_read < mbp_description_length ) {
-		if( feof( infile ) ) {
-			fprintf( stderr, "Error: unexpected end of file while reading header.\n" );
-		} else {
-			fprintf( stderr, "Error: file error while reading header.\n" );
-		}
-		abort();
-	} else {
-		mbp_description_text[ mbp_description_length ] = '\0';
-		fprintf( stderr, "Description: %s\n", mbp_description_text );
-	}
+	read_header_data( mbp_description_text, mbp_description_length );
+	mbp_description_text[ mbp_description_length ] = '\0';
+	fprintf( stderr, "Description: %s\n", mbp_description_text );
 	
 	// width and height
 	mbp_width = read_32be_int();
@@ -244,21 +272,53 @@ int main( int argc, char** argv ) {
 	// picture binary data
 	mbp_data_length = read_32be_int();
 	fprintf( stderr, "Data size: %d bytes\n", mbp_data_length );
-	mbp_data = malloc( mbp_data_length );
-	if( mbp_data == NULL ){
-		fprintf( stderr, "Error: memory allocation failed.\n" );
-		abort();
-	}
-	bytes_read = fread( mbp_data, 1, mbp_data_length, infile );
-	if( bytes_read < mbp_data_length ) {
-		if( feof( infile ) ) {
+	if( inmap != NULL ) {
+		// the picture data is used in place; a truncated file yields a truncated picture
+		mbp_data_offset = inmap_offset;
+		mbp_data = (char*) inmap + mbp_data_offset;
+		if( mbp_data_length > inmap_length - mbp_data_offset ) {
 			fprintf( stderr, "Warning: unexpected end of file while reading image data.\n" );
-		} else {
-			fprintf( stderr, "Warning: read error while reading image data.\n" );
+			mbp_data_length = inmap_length - mbp_data_offset;
+		}
+		// only the picture region is going to be read, in order, and only in mode 0
+		// or when analysing it
+		if( ( mode == 0 || analyse ) && mbp_data_length > 0 ) {
+			size_t advice_start = mbp_data_offset & ~( page_size - 1 );
+			size_t advice_length = mbp_data_offset + mbp_data_length - advice_start;
+			madvise( inmap + advice_start, advice_length, MADV_SEQUENTIAL );
+			madvise( inmap + advice_start, advice_length, MADV_WILLNEED );
+		}
+	} else {
+		mbp_data = malloc( mbp_data_length );
+		if( mbp_data == NULL ){
+			fprintf( stderr, "Error: memory allocation failed.\n" );
+			abort();
 		}
+		bytes_read = fread( mbp_data, 1, mbp_data_length, infile );
+		if( bytes_read < mbp_data_length ) {
+			if( feof( infile ) ) {
+				fprintf( stderr, "Warning: unexpected end of file while reading image data.\n" );
+			} else {
+				fprintf( stderr, "Warning: read error while reading image data.\n" );
+			}
+			mbp_data_length = bytes_read;
+		}
+		
+		if( infile != stdin ) fclose( infile );
 	}
 	
-	if( infile != stdin ) fclose( infile );
+	// picture analysis
+	if( analyse ) {
+		if( mbp_data_length < 2 || (unsigned char) mbp_data[0] != 0xff || (unsigned char) mbp_data[1] != 0xd8 ) {
+			fprintf( stderr, "Warning: picture analysis is only supported for JPEG data, skipping.\n" );
+		} else if( analyse_jpeg( (unsigned char*) mbp_data, mbp_data_length, &analysis_phash, &analysis_dhash, &analysis_colour ) == 0 ) {
+			fprintf( stderr, "Perceptual hash: %016" PRIx64 "\n", analysis_phash );
+			fprintf( stderr, "Difference hash: %016" PRIx64 "\n", analysis_dhash );
+			fprintf( stderr, "Dominant colour: #%06" PRIx32 "\n", analysis_colour );
+		} else {
+			fprintf( stderr, "Warning: could not decode picture for analysis, skipping.\n" );
+		}
+	}
 	
 	// produce requested output
 	switch( mode ){
@@ -272,32 +332,265 @@ int main( int argc, char** argv ) {
 	
 	if( outfile != stdout ) fclose( outfile );
 	
+	// drop the pages we touched from the page cache, so that extracting from
+	// many files does not evict data other processes are using; the picture
+	// region is only touched in mode 0 or when analysing it
+	if( inmap != NULL ) {
+		munmap( inmap, inmap_length );
+		if( mode == 0 || analyse )
+			posix_fadvise( infile_fd, 0, mbp_data_offset + mbp_data_length, POSIX_FADV_DONTNEED );
+		else
+			posix_fadvise( infile_fd, 0, mbp_data_offset, POSIX_FADV_DONTNEED );
+		close( infile_fd );
+	}
+	
 	return 0;
 }
 
 
 /*
-	Reads a 32-bit big-endian unsigned integer from infile.
-	infile needs to be already initialized.
+	Reads a 32-bit big-endian unsigned integer from the input (see read_header_data()).
 	Aborts the program if reaches end-of-file or an error occurs.
 	If no error occurs, the read value is converted to host endianness and returned.
 */
 uint32_t read_32be_int(){
 	
-	size_t bytes_read;
 	uint32_t value;
 	
-	bytes_read = fread( &value, 1, 4, infile );
-	if( bytes_read < 4 ) {
+	read_header_data( &value, 4 );
+	value = be32toh( value );
+	return value;
+	
+}
+
+
+/*
+	Reads length bytes of header data into buffer, either from the memory-mapped
+	input (if inmap is set) or from infile.
+	Aborts the program if reaches end-of-file or an error occurs.
+*/
+void read_header_data( void *buffer, size_t length ){
+	
+	size_t bytes_read;
+	
+	if( inmap != NULL ) {
+		if( length > inmap_length - inmap_offset ) {
+			fprintf( stderr, "Error: unexpected end of file while reading header.\n" );
+			abort();
+		}
+		memcpy( buffer, inmap + inmap_offset, length );
+		inmap_offset += length;
+		return;
+	}
+	
+	bytes_read = fread( buffer, 1, length, infile );
+	if( bytes_read < length ) {
 		if( feof( infile ) ) {
 			fprintf( stderr, "Error: unexpected end of file while reading header.\n" );
 		} else {
 			fprintf( stderr, "Error: file error while reading header.\n" );
 		}
 		abort();
-	} else {
-		value = be32toh( value );
-		return value;
 	}
 	
 }
+
+
+
+/*
+	libjpeg error handler for analyse_jpeg(): prints the message and jumps back
+	instead of terminating the program, since the analysis is optional.
+*/
+struct analysis_error_mgr {
+	struct jpeg_error_mgr pub;
+	jmp_buf setjmp_buffer;
+};
+
+void analysis_error_exit( j_common_ptr cinfo ){
+	
+	struct analysis_error_mgr *err = (struct analysis_error_mgr*) cinfo->err;
+	
+	(*cinfo->err->output_message)( cinfo );
+	longjmp( err->setjmp_buffer, 1 );
+	
+}
+
+
+/*
+	Decodes a JPEG picture at 1/8 scale (only the DC coefficient of each block is used)
+	and computes:
+	 - phash: 64-bit perceptual hash, from the 8x8 lowest non-DC frequencies of the
+	   DCT of the 32x32 grayscale picture, each bit set if above their median
+	 - dhash: 64-bit difference hash, from the 9x8 grayscale picture, each bit set
+	   if a pixel is brighter than its right neighbour
+	 - colour: dominant colour as 0xRRGGBB, the mean of the most populated cell
+	   of a 8x8x8 RGB histogram
+	Returns 0 on success, -1 if the picture cannot be decoded cleanly.
+*/
+int analyse_jpeg( const unsigned char *data, size_t length, uint64_t *phash, uint64_t *dhash, uint32_t *colour ){
+	
+	struct jpeg_decompress_struct cinfo;
+	struct analysis_error_mgr jerr;
+	unsigned char *volatile rgb = NULL;
+	unsigned char *gray;
+	JSAMPROW row;
+	int width, height, n_pixels;
+	int i, x, y, u, v;
+	
+	float small[ 32 * 32 ];
+	float dct_table[ 8 ][ 32 ];
+	float row_dct[ 32 ][ 8 ];
+	float coefficients[ 64 ];
+	float sorted[ 64 ];
+	float median;
+	
+	uint64_t histogram_count[ 512 ] = { 0 };
+	uint64_t histogram_sum[ 512 ][ 3 ] = { { 0 } };
+	int bin, best_bin;
+	
+	// decode at reduced DCT scale
+	cinfo.err = jpeg_std_error( &jerr.pub );
+	jerr.pub.error_exit = analysis_error_exit;
+	if( setjmp( jerr.setjmp_buffer ) ) {
+		jpeg_destroy_decompress( &cinfo );
+		free( rgb );
+		return -1;
+	}
+	jpeg_create_decompress( &cinfo );
+	jpeg_mem_src( &cinfo, (unsigned char*) data, length );
+	jpeg_read_header( &cinfo, TRUE );
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 8;
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.dct_method = JDCT_IFAST;
+	jpeg_start_decompress( &cinfo );
+	
+	width = cinfo.output_width;
+	height = cinfo.output_height;
+	n_pixels = width * height;
+	fprintf( stderr, "Analysing picture at %dx%d\n", width, height );
+	
+	rgb = malloc( (size_t) n_pixels * 4 );
+	if( rgb == NULL ){
+		fprintf( stderr, "Error: memory allocation failed.\n" );
+		abort();
+	}
+	while( cinfo.output_scanline < cinfo.output_height ) {
+		row = rgb + (size_t) cinfo.output_scanline * width * 3;
+		jpeg_read_scanlines( &cinfo, &row, 1 );
+	}
+	jpeg_finish_decompress( &cinfo );
+	
+	// libjpeg recovers from corrupt or truncated data by filling the rest of
+	// the picture with gray: hashes of such a picture would be meaningless
+	if( jerr.pub.num_warnings != 0 ) {
+		jpeg_destroy_decompress( &cinfo );
+		free( rgb );
+		return -1;
+	}
+	jpeg_destroy_decompress( &cinfo );
+	
+	// grayscale conversion (BT.601 luma), stored after the RGB data
+	gray = rgb + (size_t) n_pixels * 3;
+	for( i = 0; i < n_pixels; i++ )
+		gray[ i ] = ( 77 * rgb[ 3*i ] + 150 * rgb[ 3*i+1 ] + 29 * rgb[ 3*i+2 ] ) >> 8;
+	
+	// perceptual hash: separable DCT-II over the 8x8 lowest non-DC frequencies
+	// (1..8 on each axis, row and column 0 are skipped as in libpHash)
+	resample_gray( gray, width, height, small, 32, 32 );
+	for( u = 0; u < 8; u++ )
+		for( x = 0; x < 32; x++ )
+			dct_table[ u ][ x ] = cos( ( 2 * x + 1 ) * ( u + 1 ) * M_PI / 64 );
+	for( y = 0; y < 32; y++ )
+		for( u = 0; u < 8; u++ ) {
+			float sum = 0;
+			for( x = 0; x < 32; x++ )
+				sum += dct_table[ u ][ x ] * small[ 32*y + x ];
+			row_dct[ y ][ u ] = sum;
+		}
+	for( v = 0; v < 8; v++ )
+		for( u = 0; u < 8; u++ ) {
+			float sum = 0;
+			for( y = 0; y < 32; y++ )
+				sum += dct_table[ v ][ y ] * row_dct[ y ][ u ];
+			coefficients[ 8*v + u ] = sum;
+		}
+	memcpy( sorted, coefficients, sizeof( sorted ) );
+	qsort( sorted, 64, sizeof( float ), compare_floats );
+	median = ( sorted[ 31 ] + sorted[ 32 ] ) / 2;
+	*phash = 0;
+	for( i = 0; i < 64; i++ )
+		if( coefficients[ i ] > median )
+			*phash |= (uint64_t) 1 << ( 63 - i );
+	
+	// difference hash
+	resample_gray( gray, width, height, small, 9, 8 );
+	*dhash = 0;
+	for( y = 0; y < 8; y++ )
+		for( x = 0; x < 8; x++ )
+			if( small[ 9*y + x ] > small[ 9*y + x + 1 ] )
+				*dhash |= (uint64_t) 1 << ( 63 - ( 8*y + x ) );
+	
+	// dominant colour
+	for( i = 0; i < n_pixels; i++ ) {
+		bin = ( rgb[ 3*i ] >> 5 ) << 6 | ( rgb[ 3*i+1 ] >> 5 ) << 3 | ( rgb[ 3*i+2 ] >> 5 );
+		histogram_count[ bin ]++;
+		histogram_sum[ bin ][ 0 ] += rgb[ 3*i ];
+		histogram_sum[ bin ][ 1 ] += rgb[ 3*i+1 ];
+		histogram_sum[ bin ][ 2 ] += rgb[ 3*i+2 ];
+	}
+	best_bin = 0;
+	for( bin = 1; bin < 512; bin++ )
+		if( histogram_count[ bin ] > histogram_count[ best_bin ] )
+			best_bin = bin;
+	*colour =
+		( histogram_sum[ best_bin ][ 0 ] / histogram_count[ best_bin ] ) << 16 |
+		( histogram_sum[ best_bin ][ 1 ] / histogram_count[ best_bin ] ) << 8 |
+		( histogram_sum[ best_bin ][ 2 ] / histogram_count[ best_bin ] );
+	
+	free( rgb );
+	return 0;
+	
+}
+
+
+/*
+	Resamples a width x height grayscale picture to out_width x out_height by
+	averaging the pixels that fall into each output cell (area averaging).
+	If the picture is smaller than the output, pixels are repeated instead.
+*/
+void resample_gray( const unsigned char *gray, int width, int height, float *out, int out_width, int out_height ){
+	
+	int ox, oy, x, y, x0, x1, y0, y1;
+	uint32_t sum;
+	
+	for( oy = 0; oy < out_height; oy++ ) {
+		y0 = oy * height / out_height;
+		y1 = ( oy + 1 ) * height / out_height;
+		if( y1 <= y0 ) y1 = y0 + 1;
+		for( ox = 0; ox < out_width; ox++ ) {
+			x0 = ox * width / out_width;
+			x1 = ( ox + 1 ) * width / out_width;
+			if( x1 <= x0 ) x1 = x0 + 1;
+			sum = 0;
+			for( y = y0; y < y1; y++ )
+				for( x = x0; x < x1; x++ )
+					sum += gray[ (size_t) y * width + x ];
+			out[ out_width*oy + ox ] = (float) sum / ( ( y1 - y0 ) * ( x1 - x0 ) );
+		}
+	}
+	
+}
+
+
+/*
+	Comparison function for qsort() on floats.
+*/
+int compare_floats( const void *a, const void *b ){
+	
+	float fa = *(const float*) a;
+	float fb = *(const float*) b;
+	
+	return ( fa > fb ) - ( fa < fb );
+	
+}